@@ -0,0 +1,205 @@
+import numpy
+import os
+import mmap
+import struct
+import bisect
+import threading
+import time
+try:
+    import Queue
+except ImportError:
+    import queue as Queue
+
+
+MARKER, RPM, FRAME_RANGE = range(3)
+
+# kind, padding, time (s), value, first frame index, last frame index.
+RECORD = struct.Struct('<i4xddqq')
+RECORD_DTYPE = numpy.dtype([('kind', '<i4'), ('pad', '<i4'), ('time', '<f8'), ('value', '<f8'),
+                            ('first_index', '<i8'), ('last_index', '<i8')])
+# time (s) of a record and its number in the data file.
+INDEX_ENTRY = struct.Struct('<dq')
+
+
+def index_path(path):
+    return path + '.idx'
+
+
+class EventWriter(object):
+    """Append-only binary store of marker passes, RPM samples and processed frame ranges.
+
+    Records have a fixed size and must be appended in time order, as the reader bisects them. Times are absolute
+    (seconds since the epoch) and every run is opened with frame_range, which rejects a run starting before the
+    last stored event. That check happens before any detection, the detection thread itself only puts records on
+    a queue. All file access happens on a background thread which writes them in batches and
+    flushes every `flush_interval` seconds. Every `index_interval`-th record also gets an entry in the sparse time
+    index next to the data file.
+    """
+
+    def __init__(self, path, index_interval=1024, flush_interval=1.0):
+        self.index_interval = index_interval
+        self.flush_interval = flush_interval
+        # Appending to an existing store continues its record numbering, a torn last record is dropped and so
+        # are torn or stale index entries.
+        self.records = os.path.getsize(path) // RECORD.size if os.path.exists(path) else 0
+        self.data = open(path, 'ab')
+        self.data.truncate(self.records * RECORD.size)
+        self.last_time = stored_end(path, self.records)
+        self.index = open(index_path(path), 'ab')
+        self.index.truncate(len(read_index(index_path(path), self.records)[0]) * INDEX_ENTRY.size)
+        self.queue = Queue.Queue()
+        self.thread = threading.Thread(target=self._run, name='EventWriter')
+        self.thread.daemon = True
+        self.thread.start()
+
+    def frame_range(self, start_time, end_time, first_index, last_index):
+        """Opens a run covering start_time to end_time, which must not start before the last stored event.
+
+        Call it before the detection starts: it raises ValueError for a run out of order, the other methods
+        only queue records and never throw.
+        """
+        if start_time < self.last_time:
+            raise ValueError('Run starting at %f s is earlier than the last stored event at %f s.' %
+                             (start_time, self.last_time))
+        self.last_time = max(end_time, start_time)
+        self.queue.put((FRAME_RANGE, start_time, end_time, first_index, last_index))
+
+    def marker(self, marker_time, img_index):
+        self.queue.put((MARKER, marker_time, 0.0, img_index, img_index))
+
+    def rpm(self, marker_time, speed, prev_marker_index, img_index):
+        self.queue.put((RPM, marker_time, speed, prev_marker_index, img_index))
+
+    def close(self):
+        self.queue.put(None)
+        self.thread.join()
+        self.data.close()
+        self.index.close()
+
+    def _run(self):
+        last_flush = time.time()
+        running = True
+        while running:
+            try:
+                batch = [self.queue.get(timeout=self.flush_interval)]
+            except Queue.Empty:
+                batch = []
+            while True:
+                try:
+                    batch.append(self.queue.get_nowait())
+                except Queue.Empty:
+                    break
+            if None in batch:
+                batch = batch[:batch.index(None)]
+                running = False
+            for record in batch:
+                if self.records % self.index_interval == 0:
+                    self.index.write(INDEX_ENTRY.pack(record[1], self.records))
+                self.data.write(RECORD.pack(*record))
+                self.records += 1
+            if not running or time.time() - last_flush >= self.flush_interval:
+                # Data first, so the index never points past what is on disk.
+                self.data.flush()
+                self.index.flush()
+                last_flush = time.time()
+
+
+def stored_end(path, records):
+    """Returns the time the first `records` records of a store reach, the end of the last run included."""
+    if not records:
+        return float('-inf')
+    with open(path, 'rb') as data:
+        mapped = mmap.mmap(data.fileno(), records * RECORD.size, access=mmap.ACCESS_READ)
+        try:
+            stored = numpy.frombuffer(mapped, RECORD_DTYPE, records)
+            end = float(stored['time'][-1])
+            runs = numpy.flatnonzero(stored['kind'] == FRAME_RANGE)
+            if len(runs):
+                end = max(end, float(stored['value'][runs[-1]]))
+            del stored
+        finally:
+            mapped.close()
+    return end
+
+
+def read_index(path, records):
+    """Returns the times and record numbers of the valid index entries of a store holding `records` records.
+
+    Valid entries are the longest prefix of whole entries with increasing record numbers below `records`; what
+    follows comes from a torn write or points to records which were lost.
+    """
+    times, numbers = [], []
+    if not os.path.exists(path):
+        return times, numbers
+    with open(path, 'rb') as index:
+        raw = index.read()
+    for offset in range(0, len(raw) - len(raw) % INDEX_ENTRY.size, INDEX_ENTRY.size):
+        entry_time, record = INDEX_ENTRY.unpack_from(raw, offset)
+        if record >= records or (numbers and record <= numbers[-1]):
+            break
+        times.append(entry_time)
+        numbers.append(record)
+    return times, numbers
+
+
+class EventReader(object):
+    """Memory-mapped reader of a store written by EventWriter.
+
+    A time range is found by bisecting the sparse index and then the one block of records it points to, so
+    seeks are O(log n) whatever the size of the recording. Returned records are copies, so they stay valid after
+    close unmaps the file.
+    """
+
+    def __init__(self, path):
+        self.data = open(path, 'rb')
+        count = os.path.getsize(path) // RECORD.size
+        self.map = mmap.mmap(self.data.fileno(), 0, access=mmap.ACCESS_READ) if count else None
+        if self.map is not None:
+            self.records = numpy.frombuffer(self.map, RECORD_DTYPE, count)
+        else:
+            self.records = numpy.zeros(0, RECORD_DTYPE)
+        self.index_times, self.index_records = read_index(index_path(path), count)
+
+    def close(self):
+        self.records = None
+        if self.map is not None:
+            self.map.close()
+        self.data.close()
+
+    def __len__(self):
+        return len(self.records)
+
+    def _seek(self, t):
+        # First record not earlier than t.
+        block = bisect.bisect_left(self.index_times, t) - 1
+        start = self.index_records[block] if block >= 0 else 0
+        end = self.index_records[block + 1] if block + 1 < len(self.index_records) else len(self.records)
+        return start + numpy.searchsorted(self.records['time'][start:end], t, side='left')
+
+    def time_range(self, t_from, t_to, kind=None):
+        """Returns a copy of the records with t_from <= time <= t_to, of one kind if given."""
+        first = self._seek(t_from)
+        last = first + numpy.searchsorted(self.records['time'][first:], t_to, side='right')
+        selected = self.records[first:last]
+        if kind is not None:
+            return selected[selected['kind'] == kind]
+        return selected.copy()
+
+    def rpm_summary(self, t_from, t_to, bucket):
+        """Downsamples RPM samples to `bucket` seconds long bins.
+
+        Returns a list of (bin start, samples count, mean, min, max) for the bins which have any samples.
+        """
+        samples = self.time_range(t_from, t_to, RPM)
+        if not len(samples):
+            return []
+        bins = ((samples['time'] - t_from) // bucket).astype(numpy.int64)
+        bins_number = bins[-1] + 1
+        counts = numpy.bincount(bins, minlength=bins_number)
+        sums = numpy.bincount(bins, weights=samples['value'], minlength=bins_number)
+        minimums = numpy.full(bins_number, numpy.inf)
+        maximums = numpy.full(bins_number, -numpy.inf)
+        numpy.minimum.at(minimums, bins, samples['value'])
+        numpy.maximum.at(maximums, bins, samples['value'])
+        return [(t_from + i * bucket, int(counts[i]), sums[i] / counts[i], minimums[i], maximums[i])
+                for i in numpy.flatnonzero(counts)]
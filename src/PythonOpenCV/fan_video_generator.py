@@ -0,0 +1,225 @@
+import numpy
+import cv2
+import os
+import math
+import logging
+import argparse
+
+
+class RpmProfile(object):
+    """Piecewise linear rotation speed profile given as (time in s, RPM) breakpoints.
+
+    Speed is constant before the first and after the last breakpoint. Two breakpoints with the same time make
+    a step. The number of revolutions is integrated analytically so marker timestamps are exact.
+    """
+
+    def __init__(self, breakpoints):
+        if not breakpoints:
+            raise ValueError('RPM profile needs at least one breakpoint.')
+        self.times = [float(t) for t, rpm in breakpoints]
+        self.freqs = [rpm / 60.0 for t, rpm in breakpoints]
+        if any(t2 < t1 for t1, t2 in zip(self.times, self.times[1:])):
+            raise ValueError('RPM profile breakpoints must be sorted by time.')
+        # Revolutions done up to every breakpoint, t = 0 being the start of the recording.
+        self.revs = [self.freqs[0] * self.times[0]]
+        for i in range(1, len(self.times)):
+            dt = self.times[i] - self.times[i - 1]
+            self.revs.append(self.revs[-1] + 0.5 * (self.freqs[i - 1] + self.freqs[i]) * dt)
+
+    @classmethod
+    def constant(cls, rpm):
+        return cls([(0.0, rpm)])
+
+    @classmethod
+    def ramp(cls, rpm_start, rpm_end, t_start, t_end):
+        return cls([(t_start, rpm_start), (t_end, rpm_end)])
+
+    @classmethod
+    def steps(cls, rpm_list, step_duration):
+        breakpoints = []
+        for i, rpm in enumerate(rpm_list):
+            breakpoints.append((i * step_duration, rpm))
+            breakpoints.append(((i + 1) * step_duration, rpm))
+        return cls(breakpoints)
+
+    def _segment(self, t):
+        # Index of the last breakpoint not later than t, -1 before the first one.
+        i = -1
+        while i + 1 < len(self.times) and self.times[i + 1] <= t:
+            i += 1
+        return i
+
+    def revolutions(self, t):
+        i = self._segment(t)
+        if i < 0:
+            return self.freqs[0] * t
+        if i == len(self.times) - 1:
+            return self.revs[i] + self.freqs[i] * (t - self.times[i])
+        dt = t - self.times[i]
+        slope = (self.freqs[i + 1] - self.freqs[i]) / (self.times[i + 1] - self.times[i])
+        return self.revs[i] + self.freqs[i] * dt + 0.5 * slope * dt * dt
+
+    def crossing_time(self, revolution):
+        """Exact time when the given number of revolutions is reached, None if never."""
+        if revolution <= self.revs[0]:
+            if self.freqs[0] <= 0:
+                return None
+            return revolution / self.freqs[0]
+        for i in range(len(self.times) - 1):
+            if self.revs[i] <= revolution <= self.revs[i + 1] and self.revs[i + 1] > self.revs[i]:
+                f0 = self.freqs[i]
+                slope = (self.freqs[i + 1] - f0) / (self.times[i + 1] - self.times[i])
+                left = revolution - self.revs[i]
+                if slope == 0:
+                    return self.times[i] + left / f0
+                # Stable root of 0.5 * slope * dt^2 + f0 * dt - left = 0.
+                return self.times[i] + 2 * left / (f0 + math.sqrt(f0 * f0 + 2 * slope * left))
+        if self.freqs[-1] <= 0:
+            return None
+        return self.times[-1] + (revolution - self.revs[-1]) / self.freqs[-1]
+
+
+class FanVideoGenerator(object):
+    """Deterministic renderer of a rotating fan with a bright marker, seen through a camera ROI.
+
+    Defaults mimic TEST/fan_captured_images/FanImages_10kHz: the ROI looks at a patch of the fan far left of its
+    axis, dark blades stay well below the preprocessing threshold of VisualMeasurement and only the marker is
+    bright. The marker is an annular sector covering the left 60% of the ROI width, which sweeps upwards across
+    the ROI in about 10 frames per revolution. Frames are grayscale uint8 images. Every frame comes with the exact
+    times of marker passes (the marker centre crossing the ray from the axis through the ROI centre) that happen
+    within its frame period.
+    """
+    BACKGROUND, BLADE, MARKER = 15.0, 45.0, 135.0
+    # Exposure of the reference recordings, at which the brightness levels above are reached.
+    REFERENCE_EXPOSURE = 80e-6
+
+    def __init__(self, width=96, height=50, profile=None, f_acq=10000.0, exposure=80e-6, noise=5.0, seed=0,
+                 blades=7, blade_width=0.5, center=None, marker_radii=None, marker_width=0.054,
+                 exposure_samples=4):
+        self.width = width
+        self.height = height
+        self.profile = profile if profile is not None else RpmProfile.constant(5700.0)
+        self.f_acq = f_acq
+        self.exposure = exposure
+        self.noise = noise
+        self.seed = seed
+        self.blades = blades
+        self.blade_width = blade_width
+        self.marker_width = marker_width
+        self.exposure_samples = exposure_samples
+        # By default the axis is left of the ROI, so the marker sweeps upwards like in the real recordings.
+        center = center if center is not None else (-2.6 * width, height / 2.0)
+        if marker_radii is None:
+            marker_radii = (2.5 * width, 3.2 * width)
+        self.gain = exposure / self.REFERENCE_EXPOSURE
+
+        # Per pixel polar coordinates are computed once, every frame only shifts the angle. Angle 0 points from
+        # the axis to the ROI centre and grows counterclockwise on the image.
+        ys, xs = numpy.mgrid[0:height, 0:width].astype(numpy.float32)
+        xs -= center[0]
+        ys -= center[1]
+        reference = math.atan2(height / 2.0 - center[1], width / 2.0 - center[0])
+        self.angle = ((reference - numpy.arctan2(ys, xs)) / (2 * numpy.pi)) % 1.0
+        radius = numpy.hypot(xs, ys)
+        self.marker_ring = (radius >= marker_radii[0]) & (radius <= marker_radii[1])
+
+    def render(self, phase):
+        """Renders a frame with the fan turned by `phase` revolutions, without noise nor exposure blur."""
+        pitch = 1.0 / self.blades
+        # Blades and the marker are centred on angle `phase`, so the marker sits in the middle of the first blade.
+        relative = (self.angle - phase + 0.5 * pitch * self.blade_width) % 1.0
+        image = numpy.full(self.angle.shape, self.BACKGROUND, numpy.float32)
+        image[(relative % pitch) < pitch * self.blade_width] = self.BLADE
+        marker = (self.angle - phase + 0.5 * self.marker_width) % 1.0 < self.marker_width
+        image[marker & self.marker_ring] = self.MARKER
+        return image
+
+    def frame(self, index):
+        """Returns (image, marker_times) for the frame with the given 0-based index."""
+        t_start = index / self.f_acq
+        accumulated = numpy.zeros(self.angle.shape, numpy.float32)
+        for sample in range(self.exposure_samples):
+            t = t_start + self.exposure * (sample + 0.5) / self.exposure_samples
+            accumulated += self.render(self.profile.revolutions(t))
+        accumulated *= self.gain / self.exposure_samples
+        if self.noise > 0:
+            rng = numpy.random.RandomState((self.seed * 1000003 + index) % 4294967296)
+            accumulated += rng.normal(0.0, self.noise, accumulated.shape).astype(numpy.float32)
+        image = numpy.clip(accumulated, 0, 255).astype(numpy.uint8)
+        return image, self.marker_times(t_start, t_start + 1.0 / self.f_acq)
+
+    def marker_times(self, t_from, t_to):
+        times = []
+        revolution = math.floor(self.profile.revolutions(t_from))
+        if revolution < self.profile.revolutions(t_from):
+            revolution += 1
+        while True:
+            t = self.profile.crossing_time(revolution)
+            if t is None or t >= t_to:
+                break
+            if t >= t_from:
+                times.append(t)
+            revolution += 1
+        return times
+
+    def frames(self, count, first_index=0):
+        """Lazily yields (index, image, marker_times), so arbitrarily long recordings stay in constant memory."""
+        index = first_index
+        while index < first_index + count:
+            image, times = self.frame(index)
+            yield index, image, times
+            index += 1
+
+    def write_images(self, path, count, prefix='synthetic__fan', ground_truth_path=None):
+        """Writes BMP files named the way VisualMeasurement.get_image_number expects, numbered from 1.
+
+        Ground truth goes to a text file with one `image_number marker_time` line per marker pass. By default it
+        is written beside the image directory, as `<path>_ground_truth.txt`, since object_distinction takes
+        every file of the image directory for an image.
+        """
+        if ground_truth_path is None:
+            ground_truth_path = os.path.normpath(path) + '_ground_truth.txt'
+        if not os.path.isdir(path):
+            os.makedirs(path)
+        with open(ground_truth_path, 'w') as ground_truth:
+            for index, image, times in self.frames(count):
+                cv2.imwrite(os.path.join(path, '%s_%04d.bmp' % (prefix, index + 1)), image)
+                for t in times:
+                    ground_truth.write('%d %.9f\n' % (index + 1, t))
+
+
+def parse_breakpoints(breakpoints):
+    result = []
+    for breakpoint in breakpoints:
+        t, rpm = breakpoint.split(':')
+        result.append((float(t), float(rpm)))
+    return result
+
+
+def main():
+    parser = argparse.ArgumentParser('Generate synthetic images of a rotating fan with a marker.')
+    parser.add_argument('path_to_images', type=str, help='Where to write the images and ground truth.')
+    parser.add_argument('--count', '-c', type=int, default=500, help='Number of frames.')
+    parser.add_argument('--width', type=int, default=96, help='Width of the ROI (in px).')
+    parser.add_argument('--height', type=int, default=50, help='Height of the ROI (in px).')
+    parser.add_argument('--f_acq', '-f', type=float, default=10000.0, help='Frequency of acquisition (in Hz).')
+    parser.add_argument('--exposure', '-e', type=float, default=80e-6, help='Exposure time (in s).')
+    parser.add_argument('--noise', '-n', type=float, default=5.0, help='Standard deviation of the pixel noise.')
+    parser.add_argument('--seed', type=int, default=0, help='Seed of the noise.')
+    parser.add_argument('--rpm', '-r', type=str, nargs='+', default=['0:5700'],
+                        help='Speed profile as "time:rpm" breakpoints, linearly interpolated. '
+                             'Repeat a time to make a step.')
+    parser.add_argument('--loglevel', '-l', type=str, default='INFO',
+                        help='Wanted log level. One of "DEBUG", "INFO" or "WARNING".')
+    args = parser.parse_args()
+
+    logging.basicConfig(level=args.loglevel, format='%(asctime)s - %(levelname)s - %(message)s')
+    profile = RpmProfile(parse_breakpoints(args.rpm))
+    generator = FanVideoGenerator(args.width, args.height, profile=profile, f_acq=args.f_acq,
+                                  exposure=args.exposure, noise=args.noise, seed=args.seed)
+    logging.info('Writing %d frames of %dx%d to %s' % (args.count, args.width, args.height, args.path_to_images))
+    generator.write_images(args.path_to_images, args.count)
+
+
+if __name__ == '__main__':
+    main()
@@ -2,13 +2,154 @@ import numpy
 import cv2
 import os
 import logging
+import time
 import timeit
 from matplotlib import pyplot as plt
 import argparse
+import re
+from event_store import EventWriter
+
+
+class FrameScheduler(object):
+    """Decides how much work every frame gets, based on the current rotation period estimate.
+
+    Until two markers are seen every frame is processed in full. Afterwards only the frames inside a window
+    around the expected marker arrival get the full pipeline, every `decimation`-th frame outside of it gets
+    the cheap difference test and the rest is skipped. A missed marker widens the window and after
+    `max_misses` consecutive misses the period estimate is dropped, which falls back to full scanning. So does
+    a marker found after a miss, the next one then gives the new period.
+    """
+    FULL, CHEAP, SKIP = range(3)
+
+    def __init__(self, window_ratio=0.1, min_window=3, decimation=3, widen_factor=2.0, max_misses=2):
+        self.window_ratio = window_ratio
+        self.min_window = min_window
+        self.decimation = decimation
+        self.widen_factor = widen_factor
+        self.max_misses = max_misses
+        self.period = None
+        self.last_marker_index = None
+        self.window = None
+        self.misses = 0
+        self.counters = {self.FULL: 0, self.CHEAP: 0, self.SKIP: 0}
+
+    def marker_found(self, img_index):
+        """Returns True when the marker comes one revolution after the previous one, so their gap gives the speed.
+
+        After missed windows the number of revolutions in the gap is unknown: dividing it by the misses or by the
+        old period can settle on a multiple or a fraction of the true period. Such a marker only re-anchors the
+        estimate and full scanning measures the next gap.
+        """
+        if self.last_marker_index is None or self.misses > 0:
+            self.period = None
+            self.window = None
+            self.misses = 0
+            self.last_marker_index = img_index
+            return False
+        self.period = img_index - self.last_marker_index
+        self.window = max(self.min_window, int(self.period * self.window_ratio))
+        self.last_marker_index = img_index
+        return True
+
+    def decide(self, img_index):
+        mode = self._mode(img_index)
+        self.counters[mode] += 1
+        return mode
+
+    def expected_index(self):
+        return self.last_marker_index + self.period * (self.misses + 1)
+
+    def _mode(self, img_index):
+        while self.period is not None and img_index > self.expected_index() + self.window:
+            self._marker_missed()
+        if self.period is None:
+            return self.FULL
+        if abs(img_index - self.expected_index()) <= self.window:
+            return self.FULL
+        if (img_index - self.last_marker_index) % self.decimation == 0:
+            return self.CHEAP
+        return self.SKIP
+
+    def _marker_missed(self):
+        self.misses += 1
+        if self.misses > self.max_misses:
+            # The next marker found by full scanning only anchors the period, the gap to the last one is unknown.
+            self.period = None
+            self.window = None
+            self.misses = 0
+            self.last_marker_index = None
+        else:
+            self.window = int(self.window * self.widen_factor)
+
+
+class BackgroundModel(object):
+    """Running per pixel background of preprocessed frames, updated incrementally in integer arithmetic.
+
+    'ema' keeps an exponential average with weight 2**-shift in 24.8 fixed point, with rounded steps and output
+    so a constant input is reached exactly. 'median' moves every pixel towards the current frame by at most
+    `step`, which converges to an approximate median. All buffers are allocated once at the ROI size and every
+    update and foreground extraction works in place on them.
+    """
+    METHODS = ('ema', 'median')
+
+    def __init__(self, method='ema', shift=4, step=8, diff_threshold=127):
+        if method not in self.METHODS:
+            raise ValueError('Unknown background method %s. One of %s.' % (method, ', '.join(self.METHODS)))
+        self.method = method
+        self.shift = shift
+        self.step = step
+        self.diff_threshold = diff_threshold
+        self.model = None
+        self.background = None
+        self.scratch = None
+        self.subtracted = None
+        self.thresholded = None
+
+    def update(self, image):
+        if self.model is None:
+            self.model = image.astype(numpy.int32)
+            if self.method == 'ema':
+                self.model <<= 8
+            self.background = image.copy()
+            self.scratch = numpy.empty(image.shape, numpy.int32)
+            self.subtracted = numpy.empty(image.shape, numpy.uint8)
+            self.thresholded = numpy.empty(image.shape, numpy.uint8)
+            return
+        scratch = self.scratch
+        numpy.copyto(scratch, image)
+        if self.method == 'ema':
+            scratch <<= 8
+            scratch -= self.model
+            if self.shift > 0:
+                scratch += 1 << (self.shift - 1)
+                scratch >>= self.shift
+            self.model += scratch
+            numpy.add(self.model, 1 << 7, out=scratch)
+            scratch >>= 8
+        else:
+            scratch -= self.model
+            numpy.clip(scratch, -self.step, self.step, out=scratch)
+            self.model += scratch
+            numpy.copyto(scratch, self.model)
+        numpy.copyto(self.background, scratch, casting='unsafe')
+
+    def foreground(self, image):
+        # Returns a buffer of the model, valid until the next call.
+        cv2.subtract(image, self.background, dst=self.subtracted)
+        cv2.threshold(self.subtracted, self.diff_threshold, 255, cv2.THRESH_BINARY, dst=self.thresholded)
+        return self.thresholded
+
+    def apply(self, image):
+        # Foreground is taken before the update, so a marker does not fade into its own background.
+        foreground = self.foreground(image)
+        self.update(image)
+        return foreground
 
 
 class VisualMeasurement(object):
-    def __init__(self, log_level, f_acq=10000.0, file_logs=False, visualisation=False):
+    def __init__(self, log_level, f_acq=10000.0, file_logs=False, visualisation=False, scheduler=None,
+                 background=None, event_writer=None,
+                 recording_start=None):
         self.logger = logging.getLogger(__name__)
         self.logger.setLevel(log_level)
         formatter = logging.Formatter('%(asctime)s - %(levelname)s - %(message)s')
@@ -18,8 +159,17 @@ class VisualMeasurement(object):
         self.logger.addHandler(ch)
         self.f_acq = f_acq
         self.visualisation = visualisation
+        self.scheduler = scheduler
+        self.background = background
+        self.event_writer = event_writer
+        # Events are stored with absolute times (seconds since the epoch) of the first image, by default taken from
+        # the acquisition timestamp in the image names.
+        self.recording_start = recording_start
+        self.first_img_index = None
         self.prev_image = None
+        self.prev_image_index = None
         self.prev_marker_index = None
+        self.marker_visible = False
         if file_logs:
             fh = logging.FileHandler('log_from_VisualMeasurement.log')
             fh.setLevel(log_level)
@@ -35,7 +185,7 @@ class VisualMeasurement(object):
             if 31 < img_number < 40:
                 img = cv2.imread(os.path.join(path_to_images, img_file_name), 3)
                 self.logger.debug('Shape of the image: %s' % str(img.shape))
-                print img
+                print(img)
                 grayed = cv2.cvtColor(img, cv2.COLOR_BGR2GRAY)
                 blurred = cv2.blur(grayed, (5, 5))
                 ret, thresholded = cv2.threshold(blurred, 127, 255, cv2.THRESH_BINARY)
@@ -55,24 +205,89 @@ class VisualMeasurement(object):
         min_img_index = min(dict_of_images.keys())
         max_img_index = max(dict_of_images.keys())
         self.logger.debug('Indices range: %d, %d' % (min_img_index, max_img_index))
+        self.first_img_index = min_img_index
+        if self.event_writer is not None:
+            if self.recording_start is None:
+                self.recording_start = self.get_image_time(dict_of_images[min_img_index])
+            if self.recording_start is None:
+                raise ValueError('No acquisition timestamp in %s, the recording start has to be given.' %
+                                 dict_of_images[min_img_index])
+            # Rejects a run out of order before any detection, so the event store never throws during it.
+            self.event_writer.frame_range(self.event_time(min_img_index), self.event_time(max_img_index),
+                                          min_img_index, max_img_index)
 
         for img_index in range(min_img_index + 1, max_img_index):
+            if self.scheduler is not None:
+                mode = self.scheduler.decide(img_index)
+                if mode == FrameScheduler.SKIP:
+                    continue
+                if mode == FrameScheduler.CHEAP and not self.cheap_difference_test(img_index, dict_of_images,
+                                                                                   kernel, path_to_images):
+                    continue
+            if self.background is None and self.prev_image_index != img_index - 1:
+                self.prev_image = None
             self.logger.debug('Processing image number: %d' % img_index)
             img_list = self.process_one_image(dict_of_images[img_index], dict_of_images[img_index - 1],
                                               kernel, path_to_images)
 
-            if max([max(elem) for elem in img_list[8]]) == 255:
-                if self.prev_marker_index is None:
+            was_visible = self.marker_visible
+            self.marker_visible = max([max(elem) for elem in img_list[8]]) == 255
+            if self.marker_visible:
+                # Against the background model the marker stays in the foreground for its whole pass, so only its
+                # arrival counts. The previous frame difference only shows it for a few frames, hence the gap of 4.
+                if self.background is not None and was_visible:
+                    self.logger.debug('Marker still visible in image %d.' % img_index)
+                elif self.prev_marker_index is None:
                     self.prev_marker_index = img_index
+                    if self.scheduler is not None:
+                        self.scheduler.marker_found(img_index)
+                    if self.event_writer is not None:
+                        self.event_writer.marker(self.event_time(img_index), img_index)
                 elif img_index - self.prev_marker_index > 4:
-                    freq, speed = self.calculate_speed(img_index)
-                    self.logger.info('Calculated speed: %f RPM, frequency: %f Hz.' % (speed, freq))
+                    if self.event_writer is not None:
+                        self.event_writer.marker(self.event_time(img_index), img_index)
+                    if self.scheduler is None or self.scheduler.marker_found(img_index):
+                        freq, speed = self.calculate_speed(img_index)
+                        self.logger.info('Calculated speed: %f RPM, frequency: %f Hz.' % (speed, freq))
+                        if self.event_writer is not None:
+                            self.event_writer.rpm(self.event_time(img_index), speed, self.prev_marker_index,
+                                                  img_index)
+                    else:
+                        self.logger.debug('Marker at image %d found after a miss, speed not calculated.' % img_index)
                     self.prev_marker_index = img_index
                 if self.visualisation:
                     titles = ['B', 'B_Pre', 'R', 'R_Er', 'R_Dyl',
                               'R_Kraw', 'B_Kraw', 'B_Dyl', 'WYNIK']
                     self.plot_images(img_list, titles)
             self.prev_image = img_list[1]
+            self.prev_image_index = img_index
+
+        if self.scheduler is not None:
+            counters = self.scheduler.counters
+            self.logger.debug('Frames processed in full: %d, difference tested: %d, skipped: %d' %
+                              (counters[FrameScheduler.FULL], counters[FrameScheduler.CHEAP],
+                               counters[FrameScheduler.SKIP]))
+
+    def cheap_difference_test(self, img_index, dict_of_images, kernel, path_to_images):
+        # Only the subtraction and erosion of the full pipeline, enough to tell whether a marker may be present.
+        # The reference is the last processed frame (or the background model), as the previous frame was skipped.
+        if self.prev_image is None:
+            return True
+        this_img = cv2.imread(os.path.join(path_to_images, dict_of_images[img_index]), cv2.IMREAD_GRAYSCALE)
+        this_preprocessed = self.preprocessing_of_image(this_img)
+        if self.background is not None and self.background.model is not None:
+            subtracted = self.background.foreground(this_preprocessed)
+        else:
+            subtracted = cv2.subtract(this_preprocessed, self.prev_image)
+        eroded = cv2.erode(subtracted, kernel, iterations=1)
+        if cv2.countNonZero(eroded) > 0:
+            return True
+        if self.background is not None and self.background.model is not None:
+            self.background.update(this_preprocessed)
+        self.marker_visible = False
+        self.prev_image = this_preprocessed
+        self.prev_image_index = img_index
+        return False
 
     def process_one_image(self, img_name, prev_img_name, kernel, path_to_images):
         this_img = cv2.imread(os.path.join(path_to_images, img_name), cv2.IMREAD_GRAYSCALE)
@@ -80,7 +295,12 @@ class VisualMeasurement(object):
             prev_img = cv2.imread(os.path.join(path_to_images, prev_img_name), cv2.IMREAD_GRAYSCALE)
             self.prev_image = self.preprocessing_of_image(prev_img)
         this_preprocessed = self.preprocessing_of_image(this_img)
-        subtracted = cv2.subtract(this_preprocessed, self.prev_image)
+        if self.background is not None:
+            if self.background.model is None:
+                self.background.update(self.prev_image)
+            subtracted = self.background.apply(this_preprocessed)
+        else:
+            subtracted = cv2.subtract(this_preprocessed, self.prev_image)
         eroded = cv2.erode(subtracted, kernel, iterations=1)
         dilatated = cv2.dilate(eroded, kernel, iterations=1)
         sub_edges = cv2.Canny(dilatated, 100, 200)
@@ -91,6 +311,9 @@ class VisualMeasurement(object):
                     final_image]
         return img_list
 
+    def event_time(self, img_index):
+        return self.recording_start + (img_index - self.first_img_index) / self.f_acq
+
     def calculate_speed(self, current_index):
         difference = current_index - self.prev_marker_index
         f_rot = self.f_acq / difference
@@ -109,13 +332,30 @@ class VisualMeasurement(object):
         image_number = image_name[image_name.rfind('_') + 1:image_name.rfind('.')]
         return int(image_number)
 
+    @staticmethod
+    def parse_timestamp(timestamp):
+        """Converts a camera timestamp 'YYYYMMDD_HHMMSSmmm' in the local time to seconds since the epoch."""
+        seconds = time.mktime(time.strptime(timestamp[:15], '%Y%m%d_%H%M%S'))
+        return seconds + int(timestamp[15:18]) / 1000.0
+
+    @staticmethod
+    def get_image_time(image_name):
+        """Returns the acquisition start of an image named like 'camera__serial__YYYYMMDD_HHMMSSmmm_NNNN.bmp'.
+
+        None if the name carries no timestamp.
+        """
+        match = re.search(r'__(\d{8}_\d{9})_\d+\.', image_name)
+        if match is None:
+            return None
+        return VisualMeasurement.parse_timestamp(match.group(1))
+
     @staticmethod
     def plot_images(images_list, titles_list):
         images_number = len(images_list)
         if len(titles_list) != images_number:
             raise ValueError('Wrong titles number. Got %d images and %d titles.' % (images_number, len(titles_list)))
         for i, image in enumerate(images_list):
-            plt.subplot(3, (images_number + 2) / 3, i + 1)
+            plt.subplot(3, (images_number + 2) // 3, i + 1)
             plt.gray()
             plt.imshow(image)
             plt.xticks([])
@@ -132,6 +372,15 @@ def main():
                         help='Wanted log level. One of "DEBUG", "INFO" or "WARNING".')
     parser.add_argument('--visualisation', '-v', action="store_true", default=False,
                         help='Adds visualisation every time a marker appears.')
+    parser.add_argument('--scheduling', '-s', action="store_true", default=False,
+                        help='Processes in full only the frames around the expected marker arrival.')
+    parser.add_argument('--background', '-b', type=str, default=None, choices=BackgroundModel.METHODS,
+                        help='Subtracts a running background model instead of the previous frame.')
+    parser.add_argument('--event_store', '-e', type=str, default=None,
+                        help='Appends marker passes and calculated speeds to this binary event store.')
+    parser.add_argument('--recording_start', '-t', type=str, default=None,
+                        help='Local time of the first image as "YYYYMMDD_HHMMSSmmm", for the event store. '
+                             'Taken from the image names by default.')
     args = parser.parse_args()
 
     # timer = timeit.Timer('path_to_images = "../fan_captured_images/FanImages_10kHz";\
@@ -141,8 +390,20 @@ def main():
     # print 'Average time from 10 executions:', sum(times)/len(times)
     # path_to_images = "../fan_captured_images/FanImages_10kHz"
     # f = 10000.0
-    vis_meas = VisualMeasurement(args.loglevel, f_acq=args.f_acq, visualisation=args.visualisation)
-    vis_meas.object_distinction(args.path_to_images)
+    scheduler = FrameScheduler() if args.scheduling else None
+    background = BackgroundModel(args.background) if args.background is not None else None
+    recording_start = None
+    if args.recording_start is not None:
+        recording_start = VisualMeasurement.parse_timestamp(args.recording_start)
+    event_writer = EventWriter(args.event_store) if args.event_store is not None else None
+    vis_meas = VisualMeasurement(args.loglevel, f_acq=args.f_acq, visualisation=args.visualisation,
+                                 scheduler=scheduler, background=background, event_writer=event_writer,
+                                 recording_start=recording_start)
+    try:
+        vis_meas.object_distinction(args.path_to_images)
+    finally:
+        if event_writer is not None:
+            event_writer.close()
 
     # vis_meas.simple_processing_images(path_to_images)
 
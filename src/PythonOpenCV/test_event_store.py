@@ -0,0 +1,156 @@
+import os
+import shutil
+import struct
+import tempfile
+import unittest
+import numpy
+from event_store import EventWriter, EventReader, MARKER, RPM, FRAME_RANGE, RECORD, INDEX_ENTRY, index_path
+from movement_measurement import VisualMeasurement
+
+
+class EventStoreTest(unittest.TestCase):
+    def setUp(self):
+        self.directory = tempfile.mkdtemp()
+        self.path = os.path.join(self.directory, 'events.bin')
+
+    def tearDown(self):
+        shutil.rmtree(self.directory)
+
+    def write_run(self, start, markers, index_interval=4, f_acq=1000.0, rpm=60.0):
+        """Writes a run of markers at the given frame indices, with an RPM sample at every marker but the first."""
+        writer = EventWriter(self.path, index_interval=index_interval)
+        try:
+            writer.frame_range(start, start + markers[-1] / f_acq, markers[0], markers[-1])
+            for i, index in enumerate(markers):
+                writer.marker(start + index / f_acq, index)
+                if i:
+                    writer.rpm(start + index / f_acq, rpm, markers[i - 1], index)
+        finally:
+            writer.close()
+
+    def test_record_format(self):
+        self.assertEqual(RECORD.size, 40)
+        self.assertEqual(INDEX_ENTRY.size, 16)
+        self.write_run(100.0, [10, 20])
+        with open(self.path, 'rb') as data:
+            raw = data.read()
+        self.assertEqual(len(raw), 4 * RECORD.size)
+        self.assertEqual(RECORD.unpack_from(raw, 0), (FRAME_RANGE, 100.0, 100.02, 10, 20))
+        self.assertEqual(RECORD.unpack_from(raw, RECORD.size), (MARKER, 100.01, 0.0, 10, 10))
+        self.assertEqual(RECORD.unpack_from(raw, 3 * RECORD.size), (RPM, 100.02, 60.0, 10, 20))
+
+    def test_time_range_through_sparse_index(self):
+        markers = list(range(1, 200))
+        self.write_run(0.0, markers)
+        reader = EventReader(self.path)
+        try:
+            self.assertEqual(len(reader.index_records), (len(reader) + 3) // 4)
+            for first, last in [(0, 5), (37, 38), (100, 163), (198, 199)]:
+                found = reader.time_range(first / 1000.0, last / 1000.0, MARKER)
+                self.assertEqual(list(found['first_index']), list(range(max(first, 1), last + 1)))
+            self.assertEqual(len(reader.time_range(1.0, 2.0)), 0)
+            self.assertEqual(len(reader.time_range(-2.0, -1.0)), 0)
+        finally:
+            reader.close()
+
+    def test_equal_timestamps_at_boundaries(self):
+        # Every marker comes with an RPM sample of the same time, so equal times straddle the index blocks.
+        self.write_run(0.0, list(range(1, 50)), index_interval=3)
+        reader = EventReader(self.path)
+        try:
+            for index in [1, 2, 17, 49]:
+                found = reader.time_range(index / 1000.0, index / 1000.0)
+                kinds = sorted(found['kind'])
+                self.assertEqual(kinds, [MARKER] if index == 1 else [MARKER, RPM])
+        finally:
+            reader.close()
+
+    def test_reopen_appends(self):
+        self.write_run(0.0, [1, 2, 3])
+        self.write_run(10.0, [1, 2, 3])
+        reader = EventReader(self.path)
+        try:
+            self.assertEqual(len(reader), 12)
+            self.assertEqual(list(reader.index_records), [0, 4, 8])
+            self.assertEqual(len(reader.time_range(10.0, 11.0, FRAME_RANGE)), 1)
+            self.assertEqual(len(reader.time_range(0.0, 11.0, MARKER)), 6)
+        finally:
+            reader.close()
+
+    def test_run_out_of_order_is_rejected(self):
+        self.write_run(10.0, [1, 2, 3])
+        writer = EventWriter(self.path)
+        try:
+            # Starts inside the stored run, which ends at 10.003 s.
+            self.assertRaises(ValueError, writer.frame_range, 10.002, 10.1, 1, 100)
+            writer.frame_range(10.003, 10.1, 1, 100)
+            self.assertRaises(ValueError, writer.frame_range, 10.05, 10.2, 1, 100)
+        finally:
+            writer.close()
+        reader = EventReader(self.path)
+        try:
+            self.assertEqual(len(reader.time_range(0.0, 20.0, FRAME_RANGE)), 2)
+        finally:
+            reader.close()
+
+    def test_torn_writes_are_repaired(self):
+        self.write_run(0.0, list(range(1, 20)))
+        with open(self.path, 'ab') as data:
+            data.write(b'\x01' * (RECORD.size // 2))
+        with open(index_path(self.path), 'ab') as index:
+            index.write(INDEX_ENTRY.pack(1.0, 1000))
+            index.write(b'\x02' * (INDEX_ENTRY.size - 3))
+        reader = EventReader(self.path)
+        try:
+            records = len(reader)
+            self.assertTrue(all(record < records for record in reader.index_records))
+        finally:
+            reader.close()
+        writer = EventWriter(self.path, index_interval=4)
+        writer.close()
+        self.assertEqual(os.path.getsize(self.path), records * RECORD.size)
+        self.assertEqual(os.path.getsize(index_path(self.path)), (records + 3) // 4 * INDEX_ENTRY.size)
+
+        self.write_run(1.0, [1, 2])
+        reader = EventReader(self.path)
+        try:
+            self.assertEqual(len(reader), records + 4)
+            self.assertEqual(list(reader.time_range(1.0, 2.0, MARKER)['first_index']), [1, 2])
+        finally:
+            reader.close()
+
+    def test_rpm_summary_bins(self):
+        writer = EventWriter(self.path)
+        try:
+            writer.frame_range(0.0, 1.0, 1, 10000)
+            for t, speed in [(0.05, 100.0), (0.09, 300.0), (0.1, 50.0), (0.35, 400.0)]:
+                writer.rpm(t, speed, 1, 2)
+        finally:
+            writer.close()
+        reader = EventReader(self.path)
+        try:
+            summary = reader.rpm_summary(0.0, 1.0, 0.1)
+        finally:
+            reader.close()
+        self.assertEqual([(count, mean, low, high) for start, count, mean, low, high in summary],
+                         [(2, 200.0, 100.0, 300.0), (1, 50.0, 50.0, 50.0), (1, 400.0, 400.0, 400.0)])
+        self.assertEqual([round(start, 9) for start, count, mean, low, high in summary], [0.0, 0.1, 0.3])
+
+    def test_time_range_outlives_close(self):
+        self.write_run(0.0, [1, 2, 3])
+        reader = EventReader(self.path)
+        everything = reader.time_range(0.0, 1.0)
+        markers = reader.time_range(0.0, 1.0, MARKER)
+        reader.close()
+        self.assertEqual(len(everything), 6)
+        self.assertEqual(list(markers['first_index']), [1, 2, 3])
+
+    def test_time_base_from_image_names(self):
+        start = VisualMeasurement.get_image_time('acA2000-165uc__21738771__20160114_171047534_0042.bmp')
+        self.assertAlmostEqual(start, VisualMeasurement.parse_timestamp('20160114_171047534'), 9)
+        self.assertAlmostEqual(start - VisualMeasurement.parse_timestamp('20160114_171047000'), 0.534, 6)
+        self.assertEqual(VisualMeasurement.get_image_time('synthetic__fan_0042.bmp'), None)
+
+
+if __name__ == '__main__':
+    unittest.main()
@@ -0,0 +1,88 @@
+import os
+import shutil
+import tempfile
+import unittest
+from fan_video_generator import FanVideoGenerator, RpmProfile
+from movement_measurement import VisualMeasurement, FrameScheduler, BackgroundModel
+
+
+class FanVideoGeneratorTest(unittest.TestCase):
+    def setUp(self):
+        self.directory = tempfile.mkdtemp()
+        self.path_to_images = os.path.join(self.directory, 'images')
+
+    def tearDown(self):
+        shutil.rmtree(self.directory)
+
+    def detect(self, generator, count, scheduler=None, background=None):
+        """Writes the frames, runs the detection on them and returns (detected, ground truth) image numbers.
+
+        Detected numbers are those the speed is calculated at, which leaves out the first detected marker.
+        """
+        generator.write_images(self.path_to_images, count)
+        with open(self.path_to_images + '_ground_truth.txt') as ground_truth:
+            passes = [int(line.split()[0]) for line in ground_truth]
+        vis_meas = VisualMeasurement('WARNING', f_acq=generator.f_acq, scheduler=scheduler,
+                                     background=background)
+        detected = []
+        calculate_speed = vis_meas.calculate_speed
+
+        def record(current_index):
+            detected.append(current_index)
+            return calculate_speed(current_index)
+        vis_meas.calculate_speed = record
+        vis_meas.object_distinction(self.path_to_images)
+        return detected, passes
+
+    def assert_matches_ground_truth(self, detected, passes, skipped=0):
+        """Every detection must precede a marker pass and at most `skipped` passes may go without a speed."""
+        # The marker is detected as it enters the ROI, a few frames before its centre passes the ROI centre.
+        matched = []
+        for index in detected:
+            following = [number for number in passes if 0 <= number - index <= 6]
+            self.assertEqual(len(following), 1, 'No marker pass after detection at %d.' % index)
+            matched.append(following[0])
+        # The pass in image 1 precedes the first processed image and the next one gives no speed yet.
+        expected = passes[2:]
+        self.assertEqual(matched, sorted(set(matched)))
+        self.assertTrue(set(matched) <= set(expected))
+        self.assertGreaterEqual(len(matched), len(expected) - skipped)
+
+    def test_frames_are_deterministic(self):
+        first = [image for index, image, times in FanVideoGenerator(seed=3).frames(20)]
+        second = [image for index, image, times in FanVideoGenerator(seed=3).frames(20)]
+        for image_a, image_b in zip(first, second):
+            self.assertTrue((image_a == image_b).all())
+
+    def test_only_the_marker_passes_the_threshold(self):
+        for index, image, times in FanVideoGenerator().frames(200):
+            bright = (image > 100).sum()
+            phase = FanVideoGenerator().profile.revolutions(index / 10000.0) % 1.0
+            if 0.1 < phase < 0.9:
+                self.assertEqual(bright, 0)
+            self.assertLess(bright, image.size)
+
+    def test_detection_at_constant_speed(self):
+        detected, passes = self.detect(FanVideoGenerator(), 800)
+        self.assert_matches_ground_truth(detected, passes)
+
+    def test_detection_with_speed_ramps_and_scheduler(self):
+        profile = RpmProfile([(0.0, 5700.0), (0.02, 4000.0), (0.06, 7000.0)])
+        detected, passes = self.detect(FanVideoGenerator(profile=profile), 800, FrameScheduler())
+        self.assert_matches_ground_truth(detected, passes)
+
+    def test_detection_with_speed_step_and_scheduler(self):
+        profile = RpmProfile.steps([5700.0, 4500.0], 0.04)
+        detected, passes = self.detect(FanVideoGenerator(profile=profile), 1000, FrameScheduler())
+        # The first marker after the step comes past its window, its gap is not trusted for a speed.
+        self.assert_matches_ground_truth(detected, passes, skipped=1)
+
+
+    def test_detection_against_background_models(self):
+        for method in BackgroundModel.METHODS:
+            detected, passes = self.detect(FanVideoGenerator(seed=1), 800, FrameScheduler(), BackgroundModel(method))
+            self.assert_matches_ground_truth(detected, passes)
+
+
+if __name__ == '__main__':
+    unittest.main()
@@ -0,0 +1,103 @@
+import unittest
+import numpy
+from movement_measurement import FrameScheduler, BackgroundModel
+
+
+def run_scheduler(scheduler, markers, frames):
+    """Feeds the scheduler like object_distinction does, a marker being visible only in its own frame.
+
+    Returns the (index, gap) pairs for which a speed would be calculated.
+    """
+    markers = set(markers)
+    reported = []
+    prev_marker_index = None
+    for img_index in range(1, frames):
+        if scheduler.decide(img_index) == FrameScheduler.SKIP or img_index not in markers:
+            continue
+        if prev_marker_index is None:
+            scheduler.marker_found(img_index)
+            prev_marker_index = img_index
+        elif img_index - prev_marker_index > 4:
+            if scheduler.marker_found(img_index):
+                reported.append((img_index, img_index - prev_marker_index))
+            prev_marker_index = img_index
+    return reported
+
+
+class FrameSchedulerTest(unittest.TestCase):
+    def test_steady_speed_skips_frames(self):
+        scheduler = FrameScheduler()
+        reported = run_scheduler(scheduler, range(10, 5000, 100), 5000)
+        self.assertEqual(set(gap for index, gap in reported), set([100]))
+        self.assertEqual(len(reported), 49)
+        self.assertGreater(scheduler.counters[FrameScheduler.SKIP], scheduler.counters[FrameScheduler.FULL])
+
+    def test_speed_step_does_not_lock_on_period_multiple(self):
+        markers = list(range(10, 1010, 100)) + list(range(1010, 5000, 80))
+        scheduler = FrameScheduler()
+        reported = run_scheduler(scheduler, markers, 5000)
+        self.assertEqual(set(gap for index, gap in reported), set([100, 80]))
+        self.assertEqual(scheduler.period, 80)
+        self.assertEqual(reported[-1][0], markers[-1])
+
+    def test_missed_marker_is_not_reported_as_one_revolution(self):
+        markers = [index for index in range(10, 3000, 100) if index != 1510]
+        scheduler = FrameScheduler()
+        reported = run_scheduler(scheduler, markers, 3000)
+        self.assertEqual(set(gap for index, gap in reported), set([100]))
+        self.assertEqual(scheduler.period, 100)
+        self.assertNotIn(1610, [index for index, gap in reported])
+
+
+class BackgroundModelTest(unittest.TestCase):
+    def frame(self, value):
+        return numpy.full((50, 96), value, numpy.uint8)
+
+    def test_ema_reaches_constant_input_exactly(self):
+        for start, target in ((0, 200), (255, 17), (100, 101)):
+            model = BackgroundModel('ema', shift=4)
+            model.update(self.frame(start))
+            for i in range(200):
+                model.update(self.frame(target))
+            self.assertTrue((model.background == target).all())
+
+    def test_ema_step_decays_at_shift_rate(self):
+        model = BackgroundModel('ema', shift=3)
+        model.update(self.frame(0))
+        error = 160 << 8
+        for i in range(20):
+            model.update(self.frame(160))
+            expected_error = error - ((error + 4) >> 3)
+            error = (160 << 8) - int(model.model[0, 0])
+            self.assertEqual(error, expected_error)
+            self.assertAlmostEqual(error, (160 << 8) * (7.0 / 8) ** (i + 1), delta=i + 1)
+        self.assertTrue((model.model == model.model[0, 0]).all())
+
+    def test_median_reaches_constant_input_without_oscillating(self):
+        model = BackgroundModel('median', step=8)
+        model.update(self.frame(0))
+        for i in range(25):
+            model.update(self.frame(201))
+            self.assertEqual(model.background[0, 0], min(8 * (i + 1), 201))
+        model.update(self.frame(201))
+        self.assertTrue((model.background == 201).all())
+
+    def test_median_ignores_rare_outliers(self):
+        model = BackgroundModel('median', step=8)
+        model.update(self.frame(30))
+        for i in range(100):
+            model.update(self.frame(255 if i % 10 == 0 else 30))
+        self.assertLessEqual(model.background.max(), 38)
+
+    def test_foreground_reuses_buffers(self):
+        model = BackgroundModel('ema')
+        model.update(self.frame(0))
+        first = model.apply(self.frame(255))
+        self.assertTrue((first == 255).all())
+        second = model.apply(self.frame(0))
+        self.assertIs(first, second)
+        self.assertFalse(second.any())
+
+
+if __name__ == '__main__':
+    unittest.main()